@@ -0,0 +1,399 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <spawn.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+// Compare MiniShell's fork and posix_spawn launch paths, or with -w, time
+// MiniShell against a baseline shell over a suite of generated workloads
+// gcc -Wall -O2 MiniBench.c -o MiniBench
+// MiniBench [-n<commands>] [-m<heap MB>] [-w [-b<baseline>]] ./MiniShell
+
+#define DEFAULT_CMDS 2000
+#define DEFAULT_HEAP_MB 512
+#define DEFAULT_BASELINE "/bin/sh"
+#define TRUE_PATH "/bin/true"
+
+/* Shape of the generated workloads */
+#define PIPE_DEPTH 8       // Stages in a deep | pipeline
+#define ERR_PIPE_DEPTH 4   // Stages in a |& pipeline
+#define LONG_ARGS 1000     // Arguments on one long command line
+#define REDIR_LINES 16     // Redirecting commands in each sourced script
+#define BG_BATCH 16        // & jobs started between waits for them all
+#define UNIT_SIZE 16384    // Room for the text of any one unit
+
+extern char **environ;
+
+static double NowSec() {
+   struct timespec now;
+
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/* Write a script of "count" trivial commands into an anonymous file, and
+   return an fd for it positioned at the start */
+static int MakeScript(int count) {
+   int fd = memfd_create("MiniBench", 0);
+   char line[] = TRUE_PATH "\n";
+
+   while (count--)
+      write(fd, line, sizeof(line) - 1);
+   lseek(fd, 0, SEEK_SET);
+   return fd;
+}
+
+/* Run "shell" with "flag" (or no flag, if NULL) over a script of "count"
+   commands, returning the commands per second it achieved */
+static double RunShell(char *shell, char *flag, int count) {
+   int scriptFd = MakeScript(count), nullFd = open("/dev/null", O_WRONLY);
+   char *argv[] = {shell, flag, NULL};
+   double start = NowSec();
+   int child, status;
+
+   if ((child = fork()) == 0) {
+      dup2(scriptFd, 0);
+      dup2(nullFd, 1);
+      execv(shell, argv);
+      perror(shell);
+      _exit(127);
+   }
+   waitpid(child, &status, 0);
+   close(scriptFd);
+   close(nullFd);
+
+   if (!WIFEXITED(status) || WEXITSTATUS(status) == 127) {
+      fprintf(stderr, "%s did not run cleanly\n", shell);
+      return 0;
+   }
+   return count / (NowSec() - start);
+}
+
+/* Launch and reap "count" copies of /bin/true directly, by fork/exec or by
+   posix_spawn, returning launches per second */
+static double RunLaunches(int useSpawn, int count) {
+   char *argv[] = {TRUE_PATH, NULL};
+   double start = NowSec();
+   int ndx, child;
+
+   for (ndx = 0; ndx < count; ndx++) {
+      if (useSpawn)
+         posix_spawn(&child, TRUE_PATH, NULL, NULL, argv, environ);
+      else if ((child = fork()) == 0) {
+         execv(TRUE_PATH, argv);
+         _exit(127);
+      }
+      waitpid(child, NULL, 0);
+   }
+
+   return count / (NowSec() - start);
+}
+
+/* Kinds of workload in the -w suite */
+typedef enum {
+   WL_TRIVIAL,    // One trivial command per line
+   WL_PIPE,       // A deep | pipeline
+   WL_PIPE_ERR,   // A |& pipeline, stderr included
+   WL_LONG_ARGS,  // One command with a long argument list
+   WL_SOURCE,     // A sourced script of < and >> redirects
+   WL_BG,         // A batch of & jobs, then a wait for them
+   NUM_WORKLOADS
+} WorkloadKind;
+
+static const char *WorkloadNames[NUM_WORKLOADS] = {"trivial", "pipe",
+ "pipe-err", "long-args", "source", "bg-jobs"};
+
+/* Commands that one unit of each workload runs */
+static const int UnitCmds[NUM_WORKLOADS] = {1, PIPE_DEPTH, ERR_PIPE_DEPTH,
+ 1, REDIR_LINES + 1, BG_BATCH + 1};
+
+static char *TmpDir;   // Holds the sourced script and its redirect files
+
+/* Write into "unit" the text of one unit of workload "kind", in MiniShell's
+   syntax, or POSIX sh's if "isSh".  Every unit, however many lines and
+   commands it has, prints exactly one line, so a driver can tell when it
+   is done.  Return the text's length. */
+static int MakeUnit(WorkloadKind kind, int isSh, char *unit) {
+   char *pos = unit;
+   int ndx;
+
+   switch (kind) {
+   case WL_TRIVIAL:
+      pos += sprintf(pos, "/bin/echo ok\n");
+      break;
+   case WL_PIPE:
+      pos += sprintf(pos, "/bin/echo ok");
+      for (ndx = 1; ndx < PIPE_DEPTH; ndx++)
+         pos += sprintf(pos, " | /bin/cat");
+      pos += sprintf(pos, "\n");
+      break;
+   case WL_PIPE_ERR:
+      pos += sprintf(pos, "/bin/echo ok");
+      for (ndx = 1; ndx < ERR_PIPE_DEPTH; ndx++)
+         pos += sprintf(pos, isSh ? " 2>&1 | /bin/cat" : " |& /bin/cat");
+      pos += sprintf(pos, "\n");
+      break;
+   case WL_LONG_ARGS:
+      pos += sprintf(pos, "/bin/echo");
+      for (ndx = 0; ndx < LONG_ARGS; ndx++)
+         pos += sprintf(pos, " arg%d", ndx);
+      pos += sprintf(pos, "\n");
+      break;
+   case WL_SOURCE:
+      pos += sprintf(pos, "%s %s/redir.msh\n", isSh ? "." : "source", TmpDir);
+      break;
+   case WL_BG:
+      for (ndx = 0; ndx < BG_BATCH; ndx++)
+         pos += sprintf(pos, "%s &\n", TRUE_PATH);
+      pos += sprintf(pos, "%s\n/bin/echo ok\n", isSh ? "wait" : "barrier");
+      break;
+   default:
+      break;
+   }
+
+   return pos - unit;
+}
+
+/* Make TmpDir, holding the script that WL_SOURCE units source, the input
+   file it reads, and the file it appends to */
+static int MakeTmpFiles() {
+   static char dirName[] = "/tmp/MiniBenchXXXXXX";
+   char path[PATH_MAX];
+   FILE *script;
+   int ndx;
+
+   if (!(TmpDir = mkdtemp(dirName)))
+      return 0;
+
+   sprintf(path, "%s/in", TmpDir);
+   if (!(script = fopen(path, "w")))
+      return 0;
+   fprintf(script, "ok\n");
+   fclose(script);
+
+   sprintf(path, "%s/redir.msh", TmpDir);
+   if (!(script = fopen(path, "w")))
+      return 0;
+   for (ndx = 0; ndx < REDIR_LINES; ndx++)
+      if (ndx % 2)
+         fprintf(script, "/bin/echo ok >> %s/out\n", TmpDir);
+      else
+         fprintf(script, "/bin/cat < %s/in >> %s/out\n", TmpDir, TmpDir);
+   fprintf(script, "/bin/echo ok\n");
+   fclose(script);
+
+   return 1;
+}
+
+static void RemoveTmpFiles() {
+   char path[PATH_MAX];
+
+   sprintf(path, "%s/in", TmpDir);
+   unlink(path);
+   sprintf(path, "%s/out", TmpDir);
+   unlink(path);
+   sprintf(path, "%s/redir.msh", TmpDir);
+   unlink(path);
+   rmdir(TmpDir);
+}
+
+/* Start "shell" with "stdinFd" and "stdoutFd" as its stdin and stdout,
+   closing "closeFd" in the child if it is not -1.  Return its pid. */
+static int StartShell(char *shell, int stdinFd, int stdoutFd, int closeFd) {
+   char *argv[] = {shell, NULL};
+   int child;
+
+   if ((child = fork()) == 0) {
+      dup2(stdinFd, 0);
+      dup2(stdoutFd, 1);
+      if (closeFd >= 0)
+         close(closeFd);
+      execv(shell, argv);
+      perror(shell);
+      _exit(127);
+   }
+   return child;
+}
+
+/* Run "units" copies of "unit" through "shell" as one script, the way
+   RunShell does, and return the commands per second achieved */
+static double RunThroughput(char *shell, char *unit, int unitLen, int units,
+ int cmdsPerUnit) {
+   int scriptFd = memfd_create("MiniBench", 0), nullFd = open("/dev/null", O_WRONLY);
+   double start;
+   int child, status, ndx;
+
+   for (ndx = 0; ndx < units; ndx++)
+      write(scriptFd, unit, unitLen);
+   lseek(scriptFd, 0, SEEK_SET);
+
+   start = NowSec();
+   child = StartShell(shell, scriptFd, nullFd, -1);
+   waitpid(child, &status, 0);
+   close(scriptFd);
+   close(nullFd);
+
+   if (!WIFEXITED(status) || WEXITSTATUS(status) == 127) {
+      fprintf(stderr, "%s did not run cleanly\n", shell);
+      return 0;
+   }
+   return units * cmdsPerUnit / (NowSec() - start);
+}
+
+/* Return the peak resident set size of live process "pid" in KB, or -1 */
+static long PeakRSS(int pid) {
+   char path[64], line[256];
+   long rss = -1;
+   FILE *status;
+
+   sprintf(path, "/proc/%d/status", pid);
+   if (!(status = fopen(path, "r")))
+      return -1;
+   while (fgets(line, sizeof(line), status))
+      if (sscanf(line, "VmHWM: %ld", &rss) == 1)
+         break;
+   fclose(status);
+   return rss;
+}
+
+static int CompareLong(const void *a, const void *b) {
+   long left = *(const long *) a, right = *(const long *) b;
+
+   return (left > right) - (left < right);
+}
+
+/* Feed "units" copies of "unit" to "shell" through a pipe, one at a time,
+   timing each from being written to its line of output arriving, as a
+   user at a terminal would see it.  Fill "latencies" with the sorted
+   times in ns, and return the shell's own peak RSS in KB once all units
+   are done, or -1 if the shell failed. */
+static long RunLatency(char *shell, char *unit, int unitLen, int units,
+ long *latencies) {
+   int toShell[2], fromShell[2], child, status, ndx, bytes = 0;
+   char buf[UNIT_SIZE];
+   long rss;
+   double start;
+
+   pipe(toShell);
+   pipe(fromShell);
+   child = StartShell(shell, toShell[0], fromShell[1], toShell[1]);
+   close(toShell[0]);
+   close(fromShell[1]);
+
+   for (ndx = 0; ndx < units; ndx++) {
+      start = NowSec();
+      write(toShell[1], unit, unitLen);
+      while ((bytes = read(fromShell[0], buf, sizeof(buf))) > 0
+       && buf[bytes - 1] != '\n')
+         ;
+      if (bytes <= 0)
+         break;
+      latencies[ndx] = (NowSec() - start) * 1e9;
+   }
+
+   rss = PeakRSS(child);   // Still alive, waiting for its next line
+   close(toShell[1]);
+   close(fromShell[0]);
+   waitpid(child, &status, 0);
+
+   if (bytes <= 0 || !WIFEXITED(status) || WEXITSTATUS(status) == 127) {
+      fprintf(stderr, "%s did not run cleanly\n", shell);
+      return -1;
+   }
+   qsort(latencies, units, sizeof(long), CompareLong);
+   return rss;
+}
+
+/* Run workload "kind" with enough units for about "count" commands, under
+   "shell" in "isSh" syntax, and print its line of the results table */
+static void RunWorkload(WorkloadKind kind, char *shell, int isSh, int count) {
+   char unit[UNIT_SIZE];
+   int unitLen = MakeUnit(kind, isSh, unit), cmdsPerUnit = UnitCmds[kind];
+   int units = count / cmdsPerUnit > 0 ? count / cmdsPerUnit : 1;
+   long *latencies = malloc(units * sizeof(long)), rss;
+   double cmdsPerSec = RunThroughput(shell, unit, unitLen, units, cmdsPerUnit);
+
+   printf("%-10s %-12s %10.1f", WorkloadNames[kind], shell, cmdsPerSec);
+   if ((rss = RunLatency(shell, unit, unitLen, units, latencies)) < 0)
+      printf("%12s %12s %12s %10s\n", "-", "-", "-", "-");
+   else
+      printf("%12.1f %12.1f %12.1f %10ld\n", latencies[units / 2] / 1000.0,
+       latencies[(int) (units * .99)] / 1000.0, latencies[units - 1] / 1000.0,
+       rss);
+   fflush(stdout);
+   free(latencies);
+}
+
+/* Run every workload under "shell" and then "baseline", for about "count"
+   commands each.  Latencies are per unit, e.g. a whole pipeline. */
+static int RunSuite(char *shell, char *baseline, int count) {
+   WorkloadKind kind;
+
+   if (!MakeTmpFiles()) {
+      perror("MiniBench");
+      return 1;
+   }
+
+   printf("%-10s %-12s %10s %12s %12s %12s %10s\n", "workload", "shell",
+    "cmds/sec", "p50(us)", "p99(us)", "max(us)", "rss(KB)");
+   for (kind = 0; kind < NUM_WORKLOADS; kind++) {
+      RunWorkload(kind, shell, 0, count);
+      RunWorkload(kind, baseline, 1, count);
+   }
+
+   RemoveTmpFiles();
+   return 0;
+}
+
+int main(int argc, char **argv) {
+   int count = DEFAULT_CMDS, heapMB = DEFAULT_HEAP_MB, suite = 0;
+   char *heap, *baseline = DEFAULT_BASELINE;
+
+   while (*++argv && **argv == '-') {
+      if ((*argv)[1] == 'n')
+         count = atoi(*argv + 2);
+      else if ((*argv)[1] == 'm')
+         heapMB = atoi(*argv + 2);
+      else if ((*argv)[1] == 'w')
+         suite = 1;
+      else if ((*argv)[1] == 'b' && (*argv)[2])
+         baseline = *argv + 2;
+   }
+   if (!*argv || count < 1) {
+      printf("Usage: MiniBench [-n<commands>] [-m<heap MB>] [-w [-b<baseline>]]"
+       " shellPath\n");
+      return 1;
+   }
+
+   if (suite)
+      return RunSuite(*argv, baseline, count);
+
+   printf("MiniShell, %d commands\n", count);
+   printf("   fork   %10.1f cmds/sec\n", RunShell(*argv, NULL, count));
+   printf("   spawn  %10.1f cmds/sec\n", RunShell(*argv, "-s", count));
+
+   // Launch cost grows with the launcher's heap only for fork, which must
+   // copy page tables; show that with a heap the size of a long session's.
+   printf("Direct launch, %d commands\n", count);
+   printf("   fork   %10.1f cmds/sec\n", RunLaunches(0, count));
+   printf("   spawn  %10.1f cmds/sec\n", RunLaunches(1, count));
+
+   // A long-lived heap is made of small pages, not transparent huge ones
+   heap = mmap(NULL, (size_t) heapMB << 20, PROT_READ | PROT_WRITE,
+    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   madvise(heap, (size_t) heapMB << 20, MADV_NOHUGEPAGE);
+   memset(heap, 1, (size_t) heapMB << 20);   // Touch it, so it is mapped
+   printf("Direct launch with %d MB heap, %d commands\n", heapMB, count);
+   printf("   fork   %10.1f cmds/sec\n", RunLaunches(0, count));
+   printf("   spawn  %10.1f cmds/sec\n", RunLaunches(1, count));
+   munmap(heap, (size_t) heapMB << 20);
+
+   return 0;
+}
@@ -1,26 +1,118 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <spawn.h>
+#include <signal.h>
+#include <poll.h>
 #include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/mman.h>
+#include <limits.h>
+#include <time.h>
 
 // compile & run commands
 // gcc MiniShell.c SmartAlloc.c -o MiniShell
 // SafeRun -T10000000 -t5000 -p50 ./MiniShell
+// Run as "MiniShell -s" to launch commands with posix_spawn instead of fork
+// MiniShell script.msh, or MiniShell -c 'cmd', runs commands without a prompt
 
-/* Max length of commands, arguments, filenames */
-#define MAX_WORD_LEN 100
-#define WORD_FMT "%100s"
+extern char **environ;
 
-/*Prototypes*/
-static void sourceFile(char *fileName);
+/* Initial size of a line buffer, and the most read() asks for at once */
+#define READ_CHUNK 4096
+#define INIT_TOKENS 32
+
+/* Arena block size, allocation alignment, and how many freed blocks to keep */
+#define ARENA_BLOCK 4096
+#define ARENA_ALIGN 8
+#define MAX_SPARE_BLOCKS 16
+
+/* Initial slot count of the pid table; always a power of 2 */
+#define PID_TABLE_INIT 64
 
-static void cdCmd(FILE *in);
+/* Latency histogram buckets: 4 per power of 2 nanoseconds, up to 2^64 ns */
+#define STAT_BUCKETS 256
 
-/* One argument in a commandline (or the command itself) */
+/* Buckets in the command hash, and the search path used if PATH is unset */
+#define CMD_HASH_SIZE 256
+#define DEFAULT_PATH "/bin:/usr/bin"
+
+/*Prototypes*/
+static void sourceFile(char *fileName);
+static void sourceParallel(char *fileName, int slots);
+static void parBarrier();
+
+/* Reader that hands out one full line at a time, either buffered from
+   "fd", or straight from a memory image of the whole input (fd of -1) */
+typedef struct LineSrc {
+   int fd;
+   char *buf;
+   int size;   // allocated size of buf, or size of the memory image
+   int start;  // start of the first unconsumed byte
+   int end;    // end of the valid data
+   int eof;    // read() has reported end of input
+   int isFile; // fd is a regular file, so reads never block
+   int mapped; // buf is an mmap'd script, to munmap when done
+} LineSrc;
+
+/* One block of an Arena.  Allocations are carved from data[] in order. */
+typedef struct ArenaBlock {
+   struct ArenaBlock *next;
+   size_t size;   // bytes available in data[]
+   size_t used;
+   char data[];
+} ArenaBlock;
+
+/* Bump-pointer allocator holding everything belonging to one Job */
+typedef struct Arena {
+   ArenaBlock *blocks;   // Newest block first; allocations come from it
+} Arena;
+
+/* String under construction in an Arena, doubling its space as it grows */
+typedef struct StrBuf {
+   Arena *arena;
+   char *str;    // NUL terminated
+   size_t len;
+   size_t cap;   // bytes allocated for str
+} StrBuf;
+
+/* Token kinds produced by the lexer */
+typedef enum {
+   TOK_WORD,
+   TOK_PIPE,      // |
+   TOK_PIPE_ERR,  // |&
+   TOK_IN,        // <
+   TOK_OUT,       // >
+   TOK_APPEND,    // >>
+   TOK_FORCE,     // >!
+   TOK_OUT_ERR,   // >&
+   TOK_BG         // &
+} TokType;
+
+/* How each token kind appears in a Job's display string */
+static const char *TokDisplay[] = {
+   NULL, " | ", " |& ", " < ", " > ", " >> ", " >! ", " >& ", " &"
+};
+
+/* One token, as a slice of the line buffer.  Words are NUL terminated in
+   place once the whole line has been split. */
+typedef struct Token {
+   TokType type;
+   char *text;
+   int len;
+} Token;
+
+/* One argument in a commandline (or the command itself).  "value" points
+   into the Job's copy of its commandline. */
 typedef struct Arg {
-    char value[MAX_WORD_LEN + 1];
+    char *value;
     struct Arg *next;
 } Arg;
 
@@ -29,8 +121,14 @@ typedef struct Command {
     int numArgs;
     Arg *args;
     int cmdpid;
-    char inFile[MAX_WORD_LEN + 1];
-    char outFile[MAX_WORD_LEN + 1];
+    int reaped;            // Has exited and been waited for
+    int status;            // wait status, once reaped
+    struct rusage usage;   // Resources used, once reaped
+    struct timespec start; // When launched, and when reaped
+    struct timespec end;
+    struct Job *job;       // Job this command belongs to
+    char *inFile;          // NULL if no < redirect
+    char *outFile;         // NULL if no output redirect
     int outFileMode;       // 0 - default value
     //                        1 - create and write, refuse if exists (>)
     //                        2 - append (>>)
@@ -40,447 +138,1357 @@ typedef struct Command {
     struct Command *next;
 } Command;
 
-// Job is a linked list of Commands
+// Job is a linked list of Commands.  The Job, its Commands, Args and
+// strings all live in "arena", and are released together.
 typedef struct Job {
     Command *head;
     int cmdCount;
     int bg;
-    char cmdString[200];
+    int timed;             // Report resource use when done ("time" prefix)
+    int outFD;             // If not -1, where stdout goes unless redirected
+    int errFD;             // If not -1, where stderr goes unless redirected
+    char *cmdString;       // The commandline as shown by "jobs"
+    Arena arena;
+    struct Job *prev;
     struct Job *next;
 } Job;
 
-static Job *HeadJob;
+static int UseSpawn;   // Launch with posix_spawn rather than fork/exec
+
+/* open() flags for each Command outFileMode that names a file */
+static const int OutFileFlags[] = {
+   0,
+   O_WRONLY | O_CREAT | O_EXCL,     // >
+   O_WRONLY | O_CREAT | O_APPEND,   // >>
+   O_WRONLY | O_CREAT | O_TRUNC,    // >!
+   O_WRONLY | O_CREAT | O_APPEND    // >&
+};
+
+static void barrierCmd(Command *cmd);
+
+/* Phases of running a commandline that shellstats times */
+typedef enum {
+   STAT_PARSE,    // Lex and build one line's Job, once the line is read
+   STAT_PIPE,     // pipe() for one pipeline stage
+   STAT_OPEN,     // open() of one < redirect
+   STAT_FORK,     // Starting one stage, by fork or posix_spawn
+   STAT_WAIT,     // Waiting for a foreground job to finish
+   NUM_STATS
+} StatPhase;
+
+static const char *StatNames[NUM_STATS] = {"parse", "pipe", "open", "fork", "wait"};
+
+/* Fixed-bucket latency histogram for one phase */
+typedef struct StatHist {
+   long count;
+   long maxNs;
+   long buckets[STAT_BUCKETS];
+} StatHist;
+
+static int StatsOn;              // Record tracepoints at all?
+static char *StatsFile;          // If not NULL, dump stats here at exit
+static StatHist Stats[NUM_STATS];
+
+static Job *HeadJob, *TailJob;   // Oldest job first, for stable "jobs" output
+
+static int ChildFd = -1;         // signalfd that becomes readable on SIGCHLD
+static sigset_t OrigMask;        // Signal mask to restore in children
+
+/* One remembered PATH search, mapping a command name to its full path.
+   The entry and both strings are a single allocation. */
+typedef struct HashedCmd {
+   char *name;
+   char *path;
+   int hits;
+   struct HashedCmd *next;
+} HashedCmd;
+
+static HashedCmd *CmdHash[CMD_HASH_SIZE];
+static int CmdHits, CmdMisses;
+
+/* One slot of the pid table.  "pid" is 0 if the slot was never used and
+   PID_DELETED if its entry was removed. */
+typedef struct PidEntry {
+   int pid;
+   Command *cmd;
+} PidEntry;
+
+#define PID_DELETED -1
 
-// Make a new Job, given the head of the Command linked list "cmd"
-static Job *NewJob(Command *cmd) {
-   Job *rtn = malloc(sizeof(Job));
-   rtn->bg = 0;
+/* Open-addressed hash table from child pid to its Command */
+static PidEntry *PidTable;
+static int PidTableSize, PidLive, PidUsed;   // Slots, live entries, non-empty slots
+
+static ArenaBlock *SpareBlocks;   // Freed ARENA_BLOCK blocks, kept for reuse
+static int NumSpare;
+
+/* Return "bytes" of storage from "arena", adding a block if needed */
+static void *ArenaAlloc(Arena *arena, size_t bytes) {
+   ArenaBlock *block = arena->blocks;
+   size_t size;
+   void *rtn;
+
+   bytes = (bytes + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+   if (!block || block->size - block->used < bytes) {
+      if (bytes <= ARENA_BLOCK && SpareBlocks) {
+         block = SpareBlocks;
+         SpareBlocks = block->next;
+         NumSpare--;
+      }
+      else {
+         size = bytes > ARENA_BLOCK ? bytes : ARENA_BLOCK;
+         block = malloc(sizeof(ArenaBlock) + size);
+         block->size = size;
+      }
+      block->used = 0;
+      block->next = arena->blocks;
+      arena->blocks = block;
+   }
+
+   rtn = block->data + block->used;
+   block->used += bytes;
+   return rtn;
+}
+
+/* Copy "len" bytes of "str" into "arena", NUL terminated */
+static char *ArenaStrndup(Arena *arena, const char *str, size_t len) {
+   char *rtn = ArenaAlloc(arena, len + 1);
+
+   memcpy(rtn, str, len);
+   rtn[len] = '\0';
+   return rtn;
+}
+
+/* Resize "ptr", the most recent allocation from "arena", from "oldBytes" to
+   "newBytes".  This is done in place when its block has room, and by
+   moving it to a new block otherwise. */
+static void *ArenaGrow(Arena *arena, void *ptr, size_t oldBytes, size_t newBytes) {
+   ArenaBlock *block = arena->blocks;
+   size_t offset = (char *) ptr - block->data;
+   void *rtn;
+
+   newBytes = (newBytes + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+   if (offset + newBytes <= block->size) {
+      block->used = offset + newBytes;
+      return ptr;
+   }
+
+   rtn = ArenaAlloc(arena, newBytes);
+   memcpy(rtn, ptr, oldBytes);
+   return rtn;
+}
+
+static void InitStrBuf(StrBuf *buf, Arena *arena, size_t cap) {
+   buf->arena = arena;
+   buf->str = ArenaAlloc(arena, cap);
+   buf->cap = cap;
+   buf->len = 0;
+   *buf->str = '\0';
+}
+
+/* Append "len" bytes of "str" to "buf", which must be the latest allocation
+   in its arena */
+static void AppendStr(StrBuf *buf, const char *str, size_t len) {
+   size_t newCap = buf->cap;
+
+   while (buf->len + len + 1 > newCap)
+      newCap *= 2;
+   if (newCap != buf->cap) {
+      buf->str = ArenaGrow(buf->arena, buf->str, buf->len + 1, newCap);
+      buf->cap = newCap;
+   }
+   memcpy(buf->str + buf->len, str, len);
+   buf->len += len;
+   buf->str[buf->len] = '\0';
+}
+
+/* Release everything allocated from "arena" in one go */
+static void ArenaFree(Arena *arena) {
+   ArenaBlock *block;
+
+   while ((block = arena->blocks) != NULL) {
+      arena->blocks = block->next;
+      if (block->size == ARENA_BLOCK && NumSpare < MAX_SPARE_BLOCKS) {
+         block->next = SpareBlocks;
+         SpareBlocks = block;
+         NumSpare++;
+      }
+      else
+         free(block);
+   }
+}
+
+// Make a new Job, given the head of the Command linked list "cmd" and the
+// display string the lexer built for it.  The Job is carved from "arena" and
+// takes it over, so "arena" must not be used afterwards.
+static Job *NewJob(Arena *arena, Command *cmd, char *display) {
+   Job *rtn = ArenaAlloc(arena, sizeof(Job));
+
+   rtn->bg = rtn->timed = 0;
+   rtn->outFD = rtn->errFD = -1;
    rtn->head = cmd;
    rtn->cmdCount = 1;
-   rtn->next = NULL;
+   rtn->cmdString = display;
+   rtn->prev = rtn->next = NULL;
+   rtn->arena = *arena;
+   for (; cmd != NULL; cmd = cmd->next)
+      cmd->job = rtn;
 
    return rtn;
 }
 
 /* Make a new Arg, containing "str" */
-static Arg *NewArg(char *str) {
-   Arg *rtn = malloc(sizeof(Arg));
-   strncpy(rtn->value, str, MAX_WORD_LEN);
+static Arg *NewArg(Arena *arena, char *str) {
+   Arg *rtn = ArenaAlloc(arena, sizeof(Arg));
+   rtn->value = str;
    rtn->next = NULL;
 
    return rtn;
 }
 
 /* Make a new Command, with just the executable "cmd" */
-static Command *NewCommand(char *cmd) {
-   Command *rtn = malloc(sizeof(Command));
+static Command *NewCommand(Arena *arena, char *cmd) {
+   Command *rtn = ArenaAlloc(arena, sizeof(Command));
 
    rtn->numArgs = 1;
-   rtn->args = NewArg(cmd);
-   rtn->inFile[0] = rtn->outFile[0] = '\0';
+   rtn->args = NewArg(arena, cmd);
+   rtn->cmdpid = rtn->reaped = 0;
+   rtn->inFile = rtn->outFile = NULL;
    rtn->outFileMode = 0;
    rtn->next = NULL;
 
    return rtn;
 }
 
-/* Delete "cmd" and all its Args. */
-static Command *DeleteCommand(Command *cmd) {
-   Arg *temp;
+/* Delete "job" and all its Commands, Args and strings. */
+static void DeleteJob(Job *job) {
+   Arena arena = job->arena;   // The Job itself lives in its arena
+
+   ArenaFree(&arena);
+}
+
+/* Return the pid table slot for "pid": its entry if present, otherwise the
+   empty slot at the end of its probe sequence. */
+static PidEntry *FindPidSlot(int pid) {
+   unsigned ndx = (unsigned) pid * 2654435761u & (PidTableSize - 1);
+
+   while (PidTable[ndx].pid && PidTable[ndx].pid != pid)
+      ndx = (ndx + 1) & (PidTableSize - 1);
+
+   return PidTable + ndx;
+}
+
+/* Rebuild the pid table with "size" slots, dropping deleted entries */
+static void ResizePidTable(int size) {
+   PidEntry *oldTable = PidTable, *entry;
+   int oldSize = PidTableSize;
+
+   PidTable = calloc(size, sizeof(PidEntry));
+   PidTableSize = size;
+   PidUsed = PidLive;
+   for (entry = oldTable; entry < oldTable + oldSize; entry++)
+      if (entry->pid > 0)
+         *FindPidSlot(entry->pid) = *entry;
+   free(oldTable);
+}
+
+/* Record that "cmd" is running as child "pid" */
+static void AddPid(int pid, Command *cmd) {
+   PidEntry *entry;
+
+   if (4 * (PidUsed + 1) > 3 * PidTableSize)
+      ResizePidTable(PidTableSize && 2 * PidLive < PidTableSize ? PidTableSize
+       : PidTableSize ? 2 * PidTableSize : PID_TABLE_INIT);
+
+   cmd->cmdpid = pid;
+   entry = FindPidSlot(pid);
+   if (!entry->pid)
+      PidUsed++;
+   entry->pid = pid;
+   entry->cmd = cmd;
+   PidLive++;
+}
+
+/* Remove "pid" from the table, returning its Command or NULL if unknown */
+static Command *RemovePid(int pid) {
+   PidEntry *entry;
+
+   if (!PidTableSize || pid <= 0 || !(entry = FindPidSlot(pid))->pid)
+      return NULL;
+
+   entry->pid = PID_DELETED;
+   PidLive--;
+   return entry->cmd;
+}
+
+static void AppendJob(Job *job) {
+   job->next = NULL;
+   job->prev = TailJob;
+   if (TailJob)
+      TailJob->next = job;
+   else
+      HeadJob = job;
+   TailJob = job;
+}
+
+static void UnlinkJob(Job *job) {
+   if (job->prev)
+      job->prev->next = job->next;
+   else
+      HeadJob = job->next;
+   if (job->next)
+      job->next->prev = job->prev;
+   else
+      TailJob = job->prev;
+}
+
+/* Begin timing a phase into "start", if stats are being kept */
+static void StatStart(struct timespec *start) {
+   if (StatsOn)
+      clock_gettime(CLOCK_MONOTONIC, start);
+   else
+      start->tv_sec = start->tv_nsec = 0;
+}
+
+/* Return the histogram bucket for "ns": its power of 2, plus the next two
+   bits below the top one */
+static int StatBucket(unsigned long ns) {
+   int msb;
+
+   if (ns < 4)
+      return ns;
+   msb = 63 - __builtin_clzl(ns);
+   return 4 * msb + (ns >> (msb - 2) & 3);
+}
+
+/* Smallest latency that falls in "bucket", the inverse of StatBucket */
+static double StatBucketNs(int bucket) {
+   if (bucket < 4)
+      return bucket;
+   return (double) (4 + bucket % 4) * (1UL << (bucket / 4 - 2));
+}
+
+/* Record the time since "start" against "phase" */
+static void StatEnd(StatPhase phase, struct timespec *start) {
+   struct timespec now;
+   StatHist *hist = Stats + phase;
+   long ns;
 
-   while (cmd->args != NULL) {
-      temp = cmd->args;
-      cmd->args = temp->next;
-      free(temp);
+   if (!StatsOn || !(start->tv_sec | start->tv_nsec))
+      return;
+
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   ns = (now.tv_sec - start->tv_sec) * 1000000000L + now.tv_nsec - start->tv_nsec;
+   hist->count++;
+   hist->buckets[StatBucket(ns)]++;
+   if (ns > hist->maxNs)
+      hist->maxNs = ns;
+}
+
+/* Latency at fraction "pct" of "hist", to within its bucket size */
+static double StatPercentile(StatHist *hist, double pct) {
+   long seen = 0, rank = (long) (pct * hist->count);
+   int ndx;
+
+   for (ndx = 0; ndx < STAT_BUCKETS; ndx++)
+      if ((seen += hist->buckets[ndx]) > rank)
+         return StatBucketNs(ndx);
+   return hist->maxNs;
+}
+
+static void PrintStats(FILE *out) {
+   StatHist *hist;
+
+   fprintf(out, "%-6s %10s %12s %12s %12s\n", "phase", "count", "p50(us)",
+    "p99(us)", "max(us)");
+   for (hist = Stats; hist < Stats + NUM_STATS; hist++)
+      fprintf(out, "%-6s %10ld %12.1f %12.1f %12.1f\n", StatNames[hist - Stats],
+       hist->count, StatPercentile(hist, .5) / 1000,
+       StatPercentile(hist, .99) / 1000, hist->maxNs / 1000.0);
+}
+
+static double TimeSec(struct timeval *time) {
+   return time->tv_sec + time->tv_usec / 1e6;
+}
+
+static double ElapsedSec(struct timespec *from, struct timespec *to) {
+   return to->tv_sec - from->tv_sec + (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+/* Print the pid, state, wall time and, once it has been reaped, CPU time,
+   max RSS and exit code of "cmd" */
+static void PrintCmdUsage(FILE *out, Command *cmd) {
+   struct timespec now;
+
+   if (!cmd->cmdpid) {
+      fprintf(out, "%8s  not started      %s\n", "-", cmd->args->value);
+      return;
+   }
+   if (!cmd->reaped) {
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      fprintf(out, "%8d  running  %8.3fs real  %-36s%s\n", cmd->cmdpid,
+       ElapsedSec(&cmd->start, &now), "", cmd->args->value);
+      return;
    }
 
-   return cmd->next;
+   fprintf(out, "%8d  %-4s %3d %8.3fs real %7.3fs user %7.3fs sys %8ldKB  %s\n",
+    cmd->cmdpid, WIFSIGNALED(cmd->status) ? "sig" : "exit",
+    WIFSIGNALED(cmd->status) ? WTERMSIG(cmd->status) : WEXITSTATUS(cmd->status),
+    ElapsedSec(&cmd->start, &cmd->end), TimeSec(&cmd->usage.ru_utime),
+    TimeSec(&cmd->usage.ru_stime), cmd->usage.ru_maxrss, cmd->args->value);
 }
 
-// searches the given {job} has a command with the given {pid}
-// returns 1/true if found. returns 0/false if not found.
-static int CheckJobHasPID(Job *job, int pid) {
+/* Report the totals for a finished "job" on stderr: wall time from first
+   launch to last exit, summed CPU time, and the largest RSS of any stage.
+   Pipelines also get a line per stage, to show which one was slow. */
+static void ReportTimes(Job *job) {
+   struct timespec *start = &job->head->start, *end = &job->head->end;
+   double user = 0, sys = 0;
+   long maxRSS = 0;
    Command *cmd;
 
-   cmd = job->head;
-   while (cmd != NULL) {
-      if (cmd->cmdpid == pid) {
-         return 1;
-      }
-      cmd = cmd->next;
+   for (cmd = job->head; cmd != NULL; cmd = cmd->next) {
+      if (!cmd->reaped)
+         continue;
+      if (ElapsedSec(end, &cmd->end) > 0)
+         end = &cmd->end;
+      user += TimeSec(&cmd->usage.ru_utime);
+      sys += TimeSec(&cmd->usage.ru_stime);
+      if (cmd->usage.ru_maxrss > maxRSS)
+         maxRSS = cmd->usage.ru_maxrss;
    }
 
-   return 0;
+   fflush(stdout);
+   if (job->head->next != NULL)
+      for (cmd = job->head; cmd != NULL; cmd = cmd->next)
+         PrintCmdUsage(stderr, cmd);
+   fprintf(stderr, "real %.3fs  user %.3fs  sys %.3fs  maxrss %ldKB\n",
+    ElapsedSec(start, end), user, sys, maxRSS);
 }
 
-// Function goes through all jobs, checking for provided {pid} and decrements the owner job's command count
-// returns 1/true if the owner job's command count has reached 0. returns 0/false if there are still cmds remaining
-static int DecJobCmdCount(int pid) {
+// Account for the exit of child {pid} with wait status {status}: record its
+// status and {usage}, and decrement the owner job's command count.  A
+// finished background job is deleted here; a foreground job is left for
+// catchCommands.
+static void ReapPid(int pid, int status, struct rusage *usage) {
+   Command *cmd;
    Job *job;
 
-   job = HeadJob;
-   while (job != NULL) {
-      if (CheckJobHasPID(job, pid)) {
-         job->cmdCount--;
-         return !(job->cmdCount);
+   if (!(cmd = RemovePid(pid)))
+      return;
+
+   clock_gettime(CLOCK_MONOTONIC, &cmd->end);
+   cmd->reaped = 1;
+   cmd->status = status;
+   cmd->usage = *usage;
+   job = cmd->job;
+   if (!--job->cmdCount && job->bg) {
+      if (job->timed)
+         ReportTimes(job);
+      UnlinkJob(job);
+      DeleteJob(job);
+   }
+}
+
+/* Block SIGCHLD and route it to ChildFd instead, so children are reaped
+   from the same poll() that waits for input */
+static void InitReaper() {
+   sigset_t childMask;
+
+   sigemptyset(&childMask);
+   sigaddset(&childMask, SIGCHLD);
+   sigprocmask(SIG_BLOCK, &childMask, &OrigMask);
+   ChildFd = signalfd(-1, &childMask, SFD_NONBLOCK | SFD_CLOEXEC);
+}
+
+/* Collect every child that has exited so far, without blocking */
+static void ReapChildren() {
+   struct signalfd_siginfo info;
+   struct rusage usage;
+   int pid, status;
+
+   while (read(ChildFd, &info, sizeof(info)) == sizeof(info))
+      ;
+   while ((pid = wait4(-1, &status, WNOHANG, &usage)) > 0)
+      ReapPid(pid, status, &usage);
+}
+
+/* Block until "fd" is readable, reaping children whenever they exit in the
+   meantime.  With "fd" of -1, return after the next batch of exits. */
+static void WaitForEvent(int fd) {
+   struct pollfd fds[2] = {{ChildFd, POLLIN, 0}, {fd, POLLIN, 0}};
+
+   for (;;) {
+      if (poll(fds, fd < 0 ? 1 : 2, -1) < 0) {
+         if (errno == EINTR)
+            continue;
+         return;
       }
-      job = job->next;
+      if (fds[0].revents) {
+         ReapChildren();
+         if (fd < 0)
+            return;
+      }
+      if (fd >= 0 && fds[1].revents)
+         return;
    }
+}
 
-   return 0;
+static unsigned HashName(const char *name) {
+   unsigned hash = 5381;
+
+   while (*name)
+      hash = hash * 33 ^ (unsigned char) *name++;
+   return hash;
 }
 
-// Delete the Job and all of the contained Commands which has a command with the given {pid}
-static void DeleteJobWithPid(int pid) {
-   // Two pointers for walking down the linked list
-   Job *frontJob = HeadJob;
-   Job *prevJob = HeadJob;
-   Command *cmds;
+/* Forget every hashed command, e.g. because PATH changed */
+static void ClearCmdHash() {
+   HashedCmd *entry;
+   int ndx;
 
-   if (CheckJobHasPID(frontJob, pid)) {
-      HeadJob = frontJob->next;
-      cmds = frontJob->head;
-      while (cmds != NULL) {
-         cmds = DeleteCommand(cmds);
+   for (ndx = 0; ndx < CMD_HASH_SIZE; ndx++)
+      while ((entry = CmdHash[ndx]) != NULL) {
+         CmdHash[ndx] = entry->next;
+         free(entry);
       }
-      return;
+}
+
+/* Return the full path to exec for command "name", searching PATH only the
+   first time "name" is seen.  Names with a '/' are used as given.  Return
+   NULL if no executable of that name is on PATH. */
+static char *LookupCommand(char *name) {
+   HashedCmd **bucket, *entry;
+   char *path, *dir, *dirEnd;
+   int nameLen = strlen(name), dirLen;
+   struct stat info;
+
+   if (strchr(name, '/'))
+      return name;
+
+   bucket = CmdHash + HashName(name) % CMD_HASH_SIZE;
+   for (entry = *bucket; entry != NULL; entry = entry->next)
+      if (!strcmp(entry->name, name)) {
+         entry->hits++;
+         CmdHits++;
+         return entry->path;
+      }
+
+   CmdMisses++;
+   if (!(path = getenv("PATH")))
+      path = DEFAULT_PATH;
+   for (dir = path; ; dir = dirEnd + 1) {
+      dirEnd = strchrnul(dir, ':');
+      dirLen = dirEnd - dir;
+      entry = malloc(sizeof(HashedCmd) + nameLen + 1 + (dirLen ? dirLen : 1) + nameLen + 2);
+      entry->name = (char *) (entry + 1);
+      entry->path = entry->name + nameLen + 1;
+      strcpy(entry->name, name);
+      sprintf(entry->path, "%.*s/%s", dirLen ? dirLen : 1, dirLen ? dir : ".", name);
+
+      if (!stat(entry->path, &info) && S_ISREG(info.st_mode)
+       && !access(entry->path, X_OK)) {
+         entry->hits = 1;
+         entry->next = *bucket;
+         *bucket = entry;
+         return entry->path;
+      }
+      free(entry);
+      if (!*dirEnd)
+         return NULL;
    }
+}
 
-   while (!CheckJobHasPID(frontJob, pid)) {
-      prevJob = frontJob;
-      frontJob = prevJob->next;
+/* "shellstats" prints per-phase latency; "shellstats on", "off" and
+   "reset" control collection */
+static void shellstatsCmd(Command *cmd) {
+   char *arg = cmd->numArgs > 1 ? cmd->args->next->value : "";
+
+   if (!strcmp(arg, "on"))
+      StatsOn = 1;
+   else if (!strcmp(arg, "off"))
+      StatsOn = 0;
+   else if (!strcmp(arg, "reset"))
+      memset(Stats, 0, sizeof(Stats));
+   else {
+      if (!StatsOn)
+         printf("(stats are off; \"shellstats on\" or MiniShell -t to record)\n");
+      PrintStats(stdout);
    }
-   prevJob->next = frontJob->next;
-   cmds = frontJob->head;
-   while (cmds != NULL) {
-      cmds = DeleteCommand(cmds);
+}
+
+/* "hash" lists remembered commands and lookup totals; "hash -r" forgets
+   them all */
+static void hashCmd(Command *cmd) {
+   HashedCmd *entry;
+   int ndx;
+
+   if (cmd->numArgs > 1 && !strcmp(cmd->args->next->value, "-r")) {
+      ClearCmdHash();
+      return;
    }
 
-   return;
+   for (ndx = 0; ndx < CMD_HASH_SIZE; ndx++)
+      for (entry = CmdHash[ndx]; entry != NULL; entry = entry->next)
+         printf("%6d  %s\n", entry->hits, entry->path);
+   printf("hits: %d  misses: %d\n", CmdHits, CmdMisses);
 }
 
-static void cdCmd(FILE *in) {
-   char fileName[MAX_WORD_LEN + 1];
+static void cdCmd(Command *cmd) {
+   char *dirName = cmd->numArgs > 1 ? cmd->args->next->value : getenv("HOME");
 
-   fscanf(in, WORD_FMT, fileName);
-   if (chdir(fileName) == -1) {
-      printf("'%s' is not valid dir.\n", fileName);
+   if (!dirName || chdir(dirName) == -1) {
+      printf("'%s' is not valid dir.\n", dirName ? dirName : "");
    }
 }
 
-static void envSet(FILE *in) {
-   char name[MAX_WORD_LEN + 1]; // doesn't work with char *name; Abnormal termination via signal segmentation fault
-   char val[MAX_WORD_LEN + 1];
-
-   fscanf(in, WORD_FMT, name);
-   fscanf(in, WORD_FMT, val);
-   if (setenv(name, val, 1) == -1) {
+static void envSet(Command *cmd) {
+   if (cmd->numArgs < 3) {
+      printf("Usage: setenv name value\n");
+      return;
+   }
+   if (setenv(cmd->args->next->value, cmd->args->next->next->value, 1) == -1) {
       printf("Fail");
    }
+   if (!strcmp(cmd->args->next->value, "PATH"))
+      ClearCmdHash();
 }
 
-static void unEnvSet(FILE *in) {
-   char name[MAX_WORD_LEN + 1];
+static void unEnvSet(Command *cmd) {
+   char *name;
    char *var;
 
-   fscanf(in, WORD_FMT, name);
+   if (cmd->numArgs < 2) {
+      printf("Usage: unsetenv name\n");
+      return;
+   }
+   name = cmd->args->next->value;
    var = getenv(name);
    (var != NULL) ? unsetenv(name) : printf("Environmental variable not found: %s\n", name);
+   if (!strcmp(name, "PATH"))
+      ClearCmdHash();
 }
 
-static void printJobs() {
+/* "jobs" lists running jobs; "jobs -l" adds a line per command with its
+   pid, state and resource use so far */
+static void printJobs(Command *cmd) {
    Job *job = HeadJob;
+   Command *jobCmd;
+   int longForm = cmd->numArgs > 1 && !strcmp(cmd->args->next->value, "-l");
 
    while (job != NULL) {
       printf("%s\n", job->cmdString);
+      if (longForm) {
+         fflush(stdout);
+         for (jobCmd = job->head; jobCmd != NULL; jobCmd = jobCmd->next)
+            PrintCmdUsage(stdout, jobCmd);
+      }
       job = job->next;
    }
 }
 
 
-static int ShellCommand(Command *cmd, FILE *in) {
-   char nextWord[MAX_WORD_LEN + 1];
+/* "source file" runs file's lines in order; "source -j N file" keeps up
+   to N of them running at once */
+static void sourceCmd(Command *cmd) {
+   Arg *arg = cmd->args->next;
+   int slots = 0;
+
+   if (arg && !strncmp(arg->value, "-j", 2)) {
+      if (arg->value[2])
+         slots = atoi(arg->value + 2);
+      else if ((arg = arg->next) != NULL)
+         slots = atoi(arg->value);
+      arg = arg ? arg->next : NULL;
+      if (slots < 1) {
+         printf("Usage: source -j N file\n");
+         return;
+      }
+   }
+
+   if (arg == NULL)
+      printf("Usage: source [-j N] file\n");
+   else if (slots)
+      sourceParallel(arg->value, slots);
+   else
+      sourceFile(arg->value);
+}
+
+static int ShellCommand(Command *cmd) {
+   void (*builtin)(Command *) = NULL;
+   char *name;
 
    if (cmd && cmd->args && cmd->args->value) {
-      if (!strcmp(cmd->args->value, "cd")) {
-         cdCmd(in);
-         return 1;
-      }
-      if (!strcmp(cmd->args->value, "setenv")) {
-         envSet(in);
-         return 1;
+      name = cmd->args->value;
+      if (!strcmp(name, "cd"))
+         builtin = cdCmd;
+      else if (!strcmp(name, "setenv"))
+         builtin = envSet;
+      else if (!strcmp(name, "unsetenv"))
+         builtin = unEnvSet;
+      else if (!strcmp(name, "source"))
+         builtin = sourceCmd;
+      else if (!strcmp(name, "barrier"))
+         builtin = barrierCmd;
+      else if (!strcmp(name, "jobs"))
+         builtin = printJobs;
+      else if (!strcmp(name, "hash"))
+         builtin = hashCmd;
+      else if (!strcmp(name, "shellstats"))
+         builtin = shellstatsCmd;
+   }
+
+   if (builtin == NULL)
+      return 0;
+
+   parBarrier();   // Builtins are ordering points in "source -j"
+   builtin(cmd);
+   return 1;
+}
+
+/* Wait for a foreground "job" to finish, reaping any other children that
+   exit meanwhile, then delete it.  Background jobs are left to the reaper. */
+static void catchCommands(Job *job) {
+   struct timespec start;
+
+   if (job->bg == 0) {  // foreground job
+      StatStart(&start);
+      while (job->cmdCount)  // foreground job's command count
+         WaitForEvent(-1);
+      StatEnd(STAT_WAIT, &start);
+      if (job->timed)
+         ReportTimes(job);
+      UnlinkJob(job);
+      DeleteJob(job);
+   }
+}
+
+/* Return the next line from "src", without its newline and with its length
+   in *lineLen, or NULL at end of input.  The line is not NUL terminated; it
+   lives in src's buffer and is valid only until the next call. */
+static char *ReadLine(LineSrc *src, int *lineLen) {
+   char *newLine, *line;
+   int bytesRead;
+
+   while (!(newLine = memchr(src->buf + src->start, '\n', src->end - src->start))) {
+      if (src->eof) {
+         if (src->start == src->end)
+            return NULL;
+         newLine = src->buf + src->end;   // Final line has no newline
+         break;
       }
-      if (!strcmp(cmd->args->value, "unsetenv")) {
-         unEnvSet(in);
-         return 1;
+
+      if (src->start > 0) {   // Slide the partial line to the buffer front
+         memmove(src->buf, src->buf + src->start, src->end - src->start);
+         src->end -= src->start;
+         src->start = 0;
       }
-      if (!strcmp(cmd->args->value, "source")) {
-         fscanf(in, WORD_FMT, nextWord);
-         sourceFile(nextWord);
-         return 1;
+      if (src->size - src->end <= READ_CHUNK / 2) {
+         src->size *= 2;
+         src->buf = realloc(src->buf, src->size);
       }
-      if (!strcmp(cmd->args->value, "jobs")) {
-         printJobs();
+
+      if (!src->isFile)
+         WaitForEvent(src->fd);   // Keep reaping while the user is idle
+      bytesRead = read(src->fd, src->buf + src->end, src->size - src->end - 1);
+      if (bytesRead > 0)
+         src->end += bytesRead;
+      else if (bytesRead == 0 || errno != EINTR)
+         src->eof = 1;
+   }
+
+   line = src->buf + src->start;
+   *lineLen = newLine - line;
+   src->start = newLine - src->buf + (newLine < src->buf + src->end);
+   return line;
+}
+
+static void InitLineSrc(LineSrc *src, int fd) {
+   struct stat info;
+
+   src->fd = fd;
+   src->isFile = !fstat(fd, &info) && S_ISREG(info.st_mode);
+   src->size = READ_CHUNK;
+   src->buf = malloc(src->size);
+   src->start = src->end = src->eof = 0;
+}
+
+/* Serve lines straight from "len" bytes at "data", which must outlive "src" */
+static void InitMemSrc(LineSrc *src, char *data, int len) {
+   src->fd = -1;
+   src->buf = data;
+   src->size = src->end = len;
+   src->start = src->mapped = 0;
+   src->eof = src->isFile = 1;
+}
+
+/* Set up "src" to read the script "fileName", mapping it into memory when
+   possible so lines are parsed in place with no per-line reads.  Return 0
+   if the script cannot be opened. */
+static int OpenLineSrc(LineSrc *src, char *fileName) {
+   struct stat info;
+   char *data;
+   int fd;
+
+   if ((fd = open(fileName, O_RDONLY)) < 0)
+      return 0;
+
+   if (!fstat(fd, &info) && S_ISREG(info.st_mode) && info.st_size <= INT_MAX) {
+      data = info.st_size ? mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : "";
+      if (data != MAP_FAILED) {
+         close(fd);
+         InitMemSrc(src, data, info.st_size);
+         if ((src->mapped = info.st_size > 0))
+            madvise(data, info.st_size, MADV_SEQUENTIAL);
          return 1;
       }
    }
 
-   return 0;
+   InitLineSrc(src, fd);   // A pipe or device; read it in chunks
+   return 1;
 }
 
-static void handleOutputRedirect(char word[], Command *cmd, Job *job, FILE *in) {
-   if (!strcmp(word, ">")) {
-      strcat(job->cmdString, " > ");
-      cmd->outFileMode = 1;
-   }
-   else if (!strcmp(word, ">>")) {
-      strcat(job->cmdString, " >> ");
-      cmd->outFileMode = 2;
-   }
-   else if (!strcmp(word, ">!")) {
-      strcat(job->cmdString, " >! ");
-      cmd->outFileMode = 3;
-   }
-   else if (!strcmp(word, ">&")) {
-      strcat(job->cmdString, " >& ");
-      cmd->outFileMode = 4;
-   }
-   fscanf(in, WORD_FMT, cmd->outFile);
-   strcat(job->cmdString, cmd->outFile);
+static void FreeLineSrc(LineSrc *src) {
+   if (src->mapped)
+      munmap(src->buf, src->size);
+   else if (src->fd >= 0)
+      free(src->buf);
 }
 
-static void catchCommands(Job *job, int currCmdCount) {
-   int tempPID;
+/* Split "line" into tokens in a single pass, appending the display string
+   for the line to "display" as we go.  Return the number of tokens, which
+   are left in the static array *tokens. */
+static int Tokenize(char *line, Token **tokens, StrBuf *display) {
+   static Token *toks;
+   static int tokCap;
+   int numToks = 0, ndx;
+   char *pos = line;
+   Token *tok;
+
+   for (;;) {
+      while (*pos == ' ' || *pos == '\t')   /* Skip whitespace */
+         pos++;
+      if (!*pos)
+         break;
+
+      if (numToks == tokCap) {
+         tokCap = tokCap ? 2 * tokCap : INIT_TOKENS;
+         toks = realloc(toks, tokCap * sizeof(Token));
+      }
+      tok = toks + numToks++;
+      tok->text = pos;
 
-   if (job->bg == 0) {  // foreground job
-      while (currCmdCount) {  // foreground job's command count
-         tempPID = wait(NULL);   // pid found by the wait
-         if (CheckJobHasPID(job, tempPID)) { // foreground job's command
-            if (DecJobCmdCount(tempPID)) {   // decrement whatever job which has this pid 's command count
-               DeleteJobWithPid(tempPID);    // if the job has hit command count = 0, delete that job
-            }
-            currCmdCount--;
-         }
-         else {
-            if (DecJobCmdCount(tempPID)) {   // decrement whatever job which has this pid 's command count
-               DeleteJobWithPid(tempPID);    // if the job has hit command count = 0, delete that job
-            }
-         }
+      if (*pos == '|') {
+         tok->type = pos[1] == '&' ? TOK_PIPE_ERR : TOK_PIPE;
+      }
+      else if (*pos == '>') {
+         tok->type = pos[1] == '>' ? TOK_APPEND : pos[1] == '!' ? TOK_FORCE
+          : pos[1] == '&' ? TOK_OUT_ERR : TOK_OUT;
       }
+      else if (*pos == '<')
+         tok->type = TOK_IN;
+      else if (*pos == '&')
+         tok->type = TOK_BG;
+      else {
+         tok->type = TOK_WORD;
+         while (*pos && !strchr(" \t|&<>", *pos))
+            pos++;
+         tok->len = pos - tok->text;
+         if (numToks > 1 && toks[numToks - 2].type == TOK_WORD)
+            AppendStr(display, " ", 1);
+         AppendStr(display, tok->text, tok->len);
+         continue;
+      }
+
+      tok->len = tok->type == TOK_PIPE || tok->type == TOK_IN
+       || tok->type == TOK_OUT || tok->type == TOK_BG ? 1 : 2;
+      pos += tok->len;
+      AppendStr(display, TokDisplay[tok->type], strlen(TokDisplay[tok->type]));
    }
+
+   /* Operators are fully described by their type, so a word may now
+      overwrite the operator character right after it. */
+   for (ndx = 0; ndx < numToks; ndx++)
+      if (toks[ndx].type == TOK_WORD)
+         toks[ndx].text[toks[ndx].len] = '\0';
+
+   *tokens = toks;
+   return numToks;
 }
 
-/* Read from "in" a single commandline, comprising one more pipe-connected
+/* Read from "src" a single commandline, comprising one more pipe-connected
    commands.  Return head pointer to the resultant list of Commmands */
-static Job *ReadCommands(FILE *in) {
-   int nextChar;
-   char nextWord[MAX_WORD_LEN + 1];
-   Job *job;
-   Command *lastCmd;
+static Job *ReadCommands(LineSrc *src) {
+   char *line;
+   StrBuf display;
+   Token *tokens, *tok, *endTok;
+   Command *headCmd, *lastCmd;
    Arg *lastArg;
+   Job *job;
+   Arena arena = {NULL};
+   struct timespec start;
+   int numToks, lineLen, cmdCount = 1, bg = 0, timed = 0;
+
+   if (!(line = ReadLine(src, &lineLen)))
+      return NULL;
+   StatStart(&start);
+
+   /* Tokens are slices of the line, so give the line the Job's lifetime */
+   line = ArenaStrndup(&arena, line, lineLen);
+   InitStrBuf(&display, &arena, lineLen + 1);
+   numToks = Tokenize(line, &tokens, &display);
+   endTok = tokens + numToks;
+
+   /* A leading "time" asks for a resource report when the job is done */
+   if (numToks > 1 && !strcmp(tokens->text, "time") && tokens[1].type == TOK_WORD) {
+      timed = 1;
+      tokens++;
+      numToks--;
+   }
 
    /* If there is an executable, create a Command for it, else return NULL. */
-   if (1 == fscanf(in, WORD_FMT, nextWord)) {
-      lastCmd = NewCommand(nextWord);
+   if (numToks && tokens->type == TOK_WORD) {
+      headCmd = lastCmd = NewCommand(&arena, tokens->text);
       lastArg = lastCmd->args;
    }
-   else
+   else {
+      ArenaFree(&arena);
       return NULL;
+   }
+
+   for (tok = tokens + 1; tok < endTok; tok++) {
+      switch (tok->type) {
+      case TOK_WORD:
+         lastArg = lastArg->next = NewArg(&arena, tok->text);
+         lastCmd->numArgs++;
+         break;
+      case TOK_PIPE_ERR:   // stderr redirect
+         lastCmd->outFileMode = 5;
+         /* fall through */
+      case TOK_PIPE:       // A pipe indicates a new command
+         if (tok + 1 < endTok && tok[1].type == TOK_WORD) {
+            cmdCount++;
+            lastCmd = lastCmd->next = NewCommand(&arena, (++tok)->text);
+            lastArg = lastCmd->args;
+         }
+         break;
+      case TOK_IN:
+         if (tok + 1 < endTok && tok[1].type == TOK_WORD)
+            lastCmd->inFile = (++tok)->text;
+         break;
+      case TOK_BG:         // background the process
+         bg = 1;
+         break;
+      default:             // One of the output redirects
+         if (tok + 1 < endTok && tok[1].type == TOK_WORD) {
+            lastCmd->outFileMode = tok->type == TOK_OUT ? 1
+             : tok->type == TOK_APPEND ? 2 : tok->type == TOK_FORCE ? 3 : 4;
+            lastCmd->outFile = (++tok)->text;
+         }
+         break;
+      }
+   }
 
+   StatEnd(STAT_PARSE, &start);
 
    // Checks for cd setenv unsetenv source jobs
    // returns 1 if it was executed, 0 if not a shell command
-   if (ShellCommand(lastCmd, in) == 1) {
+   if (ShellCommand(headCmd) == 1) {
+      ArenaFree(&arena);
       return NULL;
    }
 
-   job = NewJob(lastCmd);
-   strcat(job->cmdString, nextWord);
-   job->next = HeadJob;
-   HeadJob = job;
-
-   /* Repeatedly process the next blank delimited string */
-   do {
-      while ((nextChar = getc(in)) == ' ')   /* Skip whitespace */
-         ;
-
-      /* If the line is not over */
-      if (nextChar != '\n' && nextChar != EOF) {
-
-         /* A pipe indicates a new command */
-         if (nextChar == '|') {
-
-            if ((nextChar = getc(in)) == '&') { // stderr redirect
-               lastCmd->outFileMode = 5;
-               strcat(job->cmdString, "|&");
-            }
-            else {
-               ungetc(nextChar, in);
-            }
-
-            if (1 == fscanf(in, WORD_FMT, nextWord)) {
-               strcat(job->cmdString, " | ");
-               strcat(job->cmdString, nextWord);
-               job->cmdCount++;
-               lastCmd = lastCmd->next = NewCommand(nextWord);
-               lastArg = lastCmd->args;
-            }
+   job = NewJob(&arena, headCmd, display.str);
+   job->cmdCount = cmdCount;
+   job->bg = bg;
+   job->timed = timed;
+   AppendJob(job);
+
+   return job;
+}
+
+/* Build a commandline arguments array in the Job's arena, and point it to
+   the Args content */
+static char **BuildArgv(Job *job, Command *cmd) {
+   char **cmdArgs, **thisArg;
+   Arg *arg;
+
+   cmdArgs = thisArg = ArenaAlloc(&job->arena, sizeof(char *) * (cmd->numArgs + 1));
+   for (arg = cmd->args; arg != NULL; arg = arg->next) {
+      *thisArg++ = arg->value;
+   }
+   *thisArg = NULL;
+
+   return cmdArgs;
+}
+
+/* Fork and exec "cmd" from "path".  "inFD", if not -1, is the pipe or file to use for
+   stdin, and "pipeFDs", if not NULL, is the out-pipe to the next command.
+   Return the child's pid, or -1 if it could not be started. */
+static int ForkCommand(Command *cmd, char *path, char **cmdArgs, int inFD,
+ int pipeFDs[]) {
+   int childPID, outFD; /* If not -1, FD of pipe or file to use for stdout */
+
+   if ((childPID = fork()) < 0) {
+      fprintf(stderr, "Error, cannot fork.\n");
+      perror("");
+   }
+   else if (!childPID) {         /* We are child */
+      sigprocmask(SIG_SETMASK, &OrigMask, NULL);
+      if (cmd->job->outFD >= 0)   /* Job-wide stdout and stderr, which */
+         dup2(cmd->job->outFD, 1);   /* any redirects below override */
+      if (cmd->job->errFD >= 0)
+         dup2(cmd->job->errFD, 2);
+      if (inFD >= 0) {            /* If special input fd is set up ...  */
+         dup2(inFD, 0);           /*   Move it to fd 0 */
+         close(inFD);             /*   Close original fd in favor of fd 0 */
+      }
+
+      outFD = -1;                 /* Set up special stdout, if any */
+      if (pipeFDs != NULL) {      /* if our parent arranged an out-pipe.. */
+         outFD = pipeFDs[1];      /*   Save its write fd as our outFD */
+         close(pipeFDs[0]);       /*   Close read fd; next cmd will read */
+      }
+      if (outFD < 0 && cmd->outFile && cmd->outFileMode == 1)  /* If no out-pipe, but a redirect > */
+      {
+         if (access(cmd->outFile, F_OK) != -1) {   // file exists
+            printf("Redirection would overwrite output\n");
+            fflush(stdout);
+            _exit(1);
          }
-         else if (nextChar == '&') { // background the process
-            job->bg = 1;
-            strcat(job->cmdString, " &");
+         else {    // file doesn't exist
+            outFD = open(cmd->outFile, O_WRONLY | O_CREAT | O_EXCL, 0644);
          }
+      }
+      if (outFD < 0 && cmd->outFile && cmd->outFileMode == 2)  /* If no out-pipe, but a redirect >> */
+         outFD = open(cmd->outFile, O_WRONLY | O_CREAT | O_APPEND, 0644);
+      if (outFD < 0 && cmd->outFile && cmd->outFileMode == 3)  /* If no out-pipe, but a redirect >! */
+         outFD = open(cmd->outFile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      if (outFD < 0 && cmd->outFile && cmd->outFileMode == 4) { /* If no out-pipe, but a redirect >& */
+         outFD = open(cmd->outFile, O_WRONLY | O_CREAT | O_APPEND, 0644);
+      }
+      /* If above code results in special stdout, dup this to fd 1 */
 
-            /* Otherwise, it's either a redirect, or a commandline arg */
-         else {
-            ungetc(nextChar, in);
-            fscanf(in, WORD_FMT, nextWord);
-            if (!strcmp(nextWord, "<")) {
-               fscanf(in, WORD_FMT, lastCmd->inFile);
-               strcat(job->cmdString, " < ");
-               strcat(job->cmdString, lastCmd->inFile);
-            }
-            else if (!strcmp(nextWord, ">") || !strcmp(nextWord, ">>") ||
-                       !strcmp(nextWord, ">!") || !strcmp(nextWord, ">&")) {
-               handleOutputRedirect(nextWord, lastCmd, job, in);
-            }
-            else {
-               lastArg = lastArg->next = NewArg(nextWord);
-               strcat(job->cmdString, " ");
-               strcat(job->cmdString, nextWord);
-               lastCmd->numArgs++;
-            }
+      if (outFD >= 0) {
+         dup2(outFD, 1);
+         if (cmd->outFileMode >= 4) {
+            dup2(outFD, 2);
          }
+         close(outFD);
       }
-   } while (nextChar != '\n' && nextChar != EOF);
 
-   return job;
+      /* Exec the command, with given args, and with stdin, stdout, stderr
+         remapped if we did so above */
+      execv(path, cmdArgs);
+      fprintf(stderr, "%s: %s\n", *cmdArgs, strerror(errno));
+      _exit(127);
+   }
+
+   return childPID;
+}
+
+/* Same contract as ForkCommand, but start "cmd" with posix_spawn, expressing
+   its redirects and pipes as file actions.  glibc runs these in a
+   CLONE_VM|CLONE_VFORK child, so no page tables are copied however large
+   the shell's heap has grown. */
+static int SpawnCommand(Command *cmd, char *path, char **cmdArgs, int inFD,
+ int pipeFDs[]) {
+   posix_spawn_file_actions_t actions;
+   posix_spawnattr_t attrs;
+   int childPID, err, outMode = cmd->outFileMode;
+
+   if (!pipeFDs && cmd->outFile && outMode == 1 && access(cmd->outFile, F_OK) != -1) {
+      printf("Redirection would overwrite output\n");
+      return -1;
+   }
+
+   posix_spawn_file_actions_init(&actions);
+   if (cmd->job->outFD >= 0)
+      posix_spawn_file_actions_adddup2(&actions, cmd->job->outFD, 1);
+   if (cmd->job->errFD >= 0)
+      posix_spawn_file_actions_adddup2(&actions, cmd->job->errFD, 2);
+   if (inFD >= 0) {
+      posix_spawn_file_actions_adddup2(&actions, inFD, 0);
+      posix_spawn_file_actions_addclose(&actions, inFD);
+   }
+   if (pipeFDs != NULL) {
+      posix_spawn_file_actions_addclose(&actions, pipeFDs[0]);
+      posix_spawn_file_actions_adddup2(&actions, pipeFDs[1], 1);
+      if (outMode >= 4)
+         posix_spawn_file_actions_adddup2(&actions, pipeFDs[1], 2);
+      posix_spawn_file_actions_addclose(&actions, pipeFDs[1]);
+   }
+   else if (cmd->outFile && outMode >= 1 && outMode <= 4) {
+      posix_spawn_file_actions_addopen(&actions, 1, cmd->outFile,
+       OutFileFlags[outMode], 0644);
+      if (outMode == 4)
+         posix_spawn_file_actions_adddup2(&actions, 1, 2);
+   }
+
+   posix_spawnattr_init(&attrs);
+   posix_spawnattr_setsigmask(&attrs, &OrigMask);
+   posix_spawnattr_setflags(&attrs, POSIX_SPAWN_SETSIGMASK);
+
+   err = posix_spawn(&childPID, path, &actions, &attrs, cmdArgs, environ);
+   posix_spawn_file_actions_destroy(&actions);
+   posix_spawnattr_destroy(&attrs);
+   if (err) {
+      fprintf(stderr, "%s: %s\n", *cmdArgs, strerror(err));
+      return -1;
+   }
+
+   return childPID;
 }
 
-static void RunCommands(Job *job) {
+/* Start every command of "job".  Return 1 if any started; otherwise the
+   job is deleted and 0 is returned. */
+static int RunCommands(Job *job) {
    Command *cmd;
-   char **cmdArgs, **thisArg;
-   Arg *arg;
+   char **cmdArgs, *path;
+   struct timespec start;
    int childPID, currJobCmdCount = 0;
    int pipeFDs[2]; /* Pipe fds for pipe between this command and the next */
-   int inFD = -1, outFD; /* If not -1, FD of pipe or file to use for stdin stdout respectively */
+   int inFD = -1; /* If not -1, FD of pipe or file to use for stdin */
 
+   fflush(stdout);   /* Children must not inherit our pending output */
    for (cmd = job->head; cmd != NULL; cmd = cmd->next) {
-      if (inFD < 0 && cmd->inFile[0]) /* If no in-pipe, but input redirect */
+      if (inFD < 0 && cmd->inFile) { /* If no in-pipe, but input redirect */
+         StatStart(&start);
          inFD = open(cmd->inFile, O_RDONLY);
+         StatEnd(STAT_OPEN, &start);
+      }
 
-      if (cmd->next != NULL)  /* If there's a next command, make an out-pipe */
+      if (cmd->next != NULL) { /* If there's a next command, make an out-pipe */
+         StatStart(&start);
          pipe(pipeFDs);
+         StatEnd(STAT_PIPE, &start);
+      }
 
-      if ((childPID = fork()) < 0) {
-         fprintf(stderr, "Error, cannot fork.\n");
-         perror("");
+      cmdArgs = BuildArgv(job, cmd);
+      clock_gettime(CLOCK_MONOTONIC, &cmd->start);
+      if (!(path = LookupCommand(*cmdArgs))) {
+         fprintf(stderr, "%s: Command not found\n", *cmdArgs);
+         childPID = -1;
+      }
+      else {
+         StatStart(&start);
+         childPID = UseSpawn
+          ? SpawnCommand(cmd, path, cmdArgs, inFD, cmd->next ? pipeFDs : NULL)
+          : ForkCommand(cmd, path, cmdArgs, inFD, cmd->next ? pipeFDs : NULL);
+         StatEnd(STAT_FORK, &start);
       }
-      else if (childPID) {      /* We are parent */
-         cmd->cmdpid = childPID;
+      if (childPID > 0) {
+         AddPid(childPID, cmd);
          currJobCmdCount++;
-         close(inFD);           /* Parent doesn't use inFd; child does */
-         if (cmd->next != NULL) {
-            close(pipeFDs[1]);  /* Parent doesn't use out-pipe; child does */
-            inFD = pipeFDs[0];  /* Next child's inFD will be out-pipe reader */
-         }
       }
-      else {                         /* We are child */
-         if (inFD >= 0) {            /* If special input fd is set up ...  */
-            dup2(inFD, 0);           /*   Move it to fd 0 */
-            close(inFD);             /*   Close original fd in favor of fd 0 */
-         }
-
-         outFD = -1;                 /* Set up special stdout, if any */
-         if (cmd->next != NULL) {    /* if our parent arranged an out-pipe.. */
-            outFD = pipeFDs[1];      /*   Save its write fd as our outFD */
-            close(pipeFDs[0]);       /*   Close read fd; next cmd will read */
-         }
-         if (outFD < 0 && cmd->outFile[0] && cmd->outFileMode == 1)  /* If no out-pipe, but a redirect > */
-         {
-            if (access(cmd->outFile, F_OK) != -1) {   // file exists
-               printf("Redirection would overwrite output\n");
-               break;
-            }
-            else {    // file doesn't exist
-               outFD = open(cmd->outFile, O_WRONLY | O_CREAT | O_EXCL, 0644);
-            }
-         }
-         if (outFD < 0 && cmd->outFile[0] && cmd->outFileMode == 2)  /* If no out-pipe, but a redirect >> */
-            outFD = open(cmd->outFile, O_WRONLY | O_CREAT | O_APPEND, 0644);
-         if (outFD < 0 && cmd->outFile[0] && cmd->outFileMode == 3)  /* If no out-pipe, but a redirect >! */
-            outFD = open(cmd->outFile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-         if (outFD < 0 && cmd->outFile[0] && cmd->outFileMode == 4) { /* If no out-pipe, but a redirect >& */
-            outFD = open(cmd->outFile, O_WRONLY | O_CREAT | O_APPEND, 0644);
-         }
-         /* If above code results in special stdout, dup this to fd 1 */
-
-         if (outFD >= 0) {
-            dup2(outFD, 1);
-            if (cmd->outFileMode >= 4) {
-               dup2(outFD, 2);
-            }
-            close(outFD);
-         }
-
-         /* Build a commandline arguments array, and point it to Args content */
-         cmdArgs = thisArg = calloc(sizeof(char *), (size_t) (cmd->numArgs + 1));
-         for (arg = cmd->args; arg != NULL; arg = arg->next) {
-            *thisArg++ = arg->value;
-         }
 
-         /* Exec the command, with given args, and with stdin, stdout, stderr
-            remapped if we did so above */
-         execvp(*cmdArgs, cmdArgs);
+      close(inFD);           /* Parent doesn't use inFd; child does */
+      inFD = -1;
+      if (cmd->next != NULL) {
+         close(pipeFDs[1]);  /* Parent doesn't use out-pipe; child does */
+         inFD = pipeFDs[0];  /* Next child's inFD will be out-pipe reader */
       }
    }
-   catchCommands(job, currJobCmdCount);
+
+   /* Only commands that were actually started will ever be reaped */
+   if (!(job->cmdCount = currJobCmdCount)) {
+      UnlinkJob(job);
+      DeleteJob(job);
+      return 0;
+   }
+   return 1;
 }
 
 
 static void sourceFile(char *fileName) {
-   Command *cmd;
    Job *job;
-   FILE *fp;
+   LineSrc src;
 
-   if (!(fp = fopen(fileName, "r")))
+   if (!OpenLineSrc(&src, fileName))
       perror("");
    else {
-      while (!feof(fp)) {
-         if ((job = ReadCommands(fp)) != NULL) {
-            if ((job->head) != NULL) {
-               RunCommands(job);
-            }
+      while (!src.eof || src.start < src.end) {
+         if ((job = ReadCommands(&src)) != NULL && RunCommands(job)) {
+            catchCommands(job);   // The Job is deleted once it is reaped
          }
+      }
+      if (src.fd >= 0)
+         close(src.fd);
+      FreeLineSrc(&src);
+   }
+}
+
+/* A job started by "source -j", with the anonymous file collecting its
+   stdout and stderr */
+typedef struct ParJob {
+   Job *job;
+   int outFD;
+} ParJob;
+
+/* Jobs started by the innermost "source -j", oldest first.  Their output
+   is printed in that order, each job's all at once, as they finish. */
+typedef struct ParQueue {
+   ParJob *jobs;
+   int cap, head, tail;   // jobs[head..tail) are started but not printed
+} ParQueue;
+
+static ParQueue *CurParQueue;
+
+/* Print and delete finished jobs from the front of "queue", stopping at
+   the first one still running.  Return how many jobs remain running. */
+static int FlushParJobs(ParQueue *queue) {
+   ParJob *parJob;
+   char buf[READ_CHUNK];
+   int bytes, running = 0, ndx;
+
+   fflush(stdout);
+   for (; queue->head < queue->tail; queue->head++) {
+      parJob = queue->jobs + queue->head;
+      if (parJob->job->cmdCount)
+         break;
+      lseek(parJob->outFD, 0, SEEK_SET);
+      while ((bytes = read(parJob->outFD, buf, sizeof(buf))) > 0)
+         write(1, buf, bytes);
+      close(parJob->outFD);
+      if (parJob->job->timed)
+         ReportTimes(parJob->job);
+      UnlinkJob(parJob->job);
+      DeleteJob(parJob->job);
+   }
+
+   for (ndx = queue->head; ndx < queue->tail; ndx++)
+      running += queue->jobs[ndx].job->cmdCount > 0;
+   return running;
+}
+
+/* Wait until every job in "queue" is finished and printed */
+static void DrainParJobs(ParQueue *queue) {
+   while (FlushParJobs(queue) || queue->head < queue->tail)
+      WaitForEvent(-1);
+}
 
-         if (job != NULL && !job->bg) {
-            cmd = job->head;
-            while (cmd != NULL) {
-               cmd = DeleteCommand(cmd);
-            }
+/* "barrier" waits for all jobs started so far by the current "source -j",
+   or, outside one, for all background jobs */
+static void barrierCmd(Command *cmd) {
+   Job *job;
+
+   if (CurParQueue)
+      DrainParJobs(CurParQueue);
+   else
+      for (job = HeadJob; job != NULL; job = job->next)
+         while (job->cmdCount)
+            WaitForEvent(-1);
+}
+
+/* If a "source -j" is running, let its jobs finish before a builtin runs */
+static void parBarrier() {
+   if (CurParQueue)
+      DrainParJobs(CurParQueue);
+}
+
+/* Run the lines of "fileName" as independent jobs, keeping up to "slots"
+   running at once.  Builtins, "barrier" among them, wait for all earlier
+   lines first, so they act as ordering points. */
+static void sourceParallel(char *fileName, int slots) {
+   ParQueue queue = {NULL, 0, 0, 0}, *outerQueue = CurParQueue;
+   LineSrc src;
+   Job *job;
+
+   if (!OpenLineSrc(&src, fileName)) {
+      perror("");
+      return;
+   }
+
+   CurParQueue = &queue;
+   while (!src.eof || src.start < src.end) {
+      if ((job = ReadCommands(&src)) == NULL)
+         continue;
+
+      while (FlushParJobs(&queue) >= slots)
+         WaitForEvent(-1);
+
+      if (queue.tail == queue.cap) {   // Reclaim printed slots, or grow
+         if (queue.head > 0) {
+            memmove(queue.jobs, queue.jobs + queue.head,
+             (queue.tail - queue.head) * sizeof(ParJob));
+            queue.tail -= queue.head;
+            queue.head = 0;
+         }
+         else {
+            queue.cap = queue.cap ? 2 * queue.cap : slots;
+            queue.jobs = realloc(queue.jobs, queue.cap * sizeof(ParJob));
          }
       }
+
+      job->bg = 0;   // Finished jobs wait here to have their output printed
+      job->outFD = job->errFD = memfd_create("source", MFD_CLOEXEC);
+      queue.jobs[queue.tail].job = job;
+      queue.jobs[queue.tail].outFD = job->outFD;
+      if (RunCommands(job))
+         queue.tail++;
+      else
+         close(queue.jobs[queue.tail].outFD);
    }
+   DrainParJobs(&queue);
+   CurParQueue = outerQueue;
+
+   free(queue.jobs);
+   if (src.fd >= 0)
+      close(src.fd);
+   FreeLineSrc(&src);
 }
 
-int main() {
-   Command *cmd;
+/* Usage: MiniShell [-s] [-t[statsFile]] [-c command | script]
+   With neither a command nor a script, read commands from stdin, prompting
+   only if stdin is a terminal. */
+int main(int argc, char **argv) {
    Job *job;
+   LineSrc src;
+   char *command = NULL;
+   FILE *statsOut;
+   int prompt;
+
+   while (*++argv && **argv == '-') {
+      if (!strcmp(*argv, "-s"))   // Launch commands with posix_spawn
+         UseSpawn = 1;
+      else if (!strcmp(*argv, "-c") && argv[1])   // Run just this command
+         command = *++argv;
+      else if (!strncmp(*argv, "-t", 2)) {   // Keep stats, and maybe dump them
+         StatsOn = 1;
+         StatsFile = (*argv)[2] ? *argv + 2 : NULL;
+      }
+   }
 
-   /* Repeatedly print a prompt, read a commandline, run it, and delete it */
-   while (!feof(stdin)) {
-      printf(">> ");
+   InitReaper();
+   if (command)
+      InitMemSrc(&src, command, strlen(command));
+   else if (*argv) {
+      if (!OpenLineSrc(&src, *argv)) {
+         perror(*argv);
+         return 1;
+      }
+   }
+   else
+      InitLineSrc(&src, 0);
+   prompt = !command && !*argv && isatty(0);
 
-      if ((job = ReadCommands(stdin)) != NULL) {
-         if ((cmd = job->head) != NULL) {
-            RunCommands(job);
-         }
+   /* Repeatedly print a prompt, read a commandline, run it, and delete it */
+   while (!src.eof || src.start < src.end) {
+      if (prompt) {
+         printf(">> ");
+         fflush(stdout);
       }
-      if (job != NULL && !job->bg) {
-         cmd = job->head;
-         while (cmd != NULL) {
-            cmd = DeleteCommand(cmd);
-         }
+
+      if ((job = ReadCommands(&src)) != NULL && RunCommands(job)) {
+         catchCommands(job);   // The Job is deleted once it is reaped
       }
    }
-}
\ No newline at end of file
+   FreeLineSrc(&src);
+
+   if (StatsFile && (statsOut = fopen(StatsFile, "w")) != NULL) {
+      PrintStats(statsOut);
+      fclose(statsOut);
+   }
+
+   return 0;
+}